@@ -0,0 +1,119 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "adaptive.h"
+
+// Additive increase steps to go from slowest to fastest rate
+#define AIMD_STEPS 32
+// Latency this far above the best seen counts as the device falling behind
+#define CONGESTION_FACTOR 2.0
+#define CONGESTION_SLACK_US 2000.0
+
+static void set_bounds(adaptive_rate *ar, int min_period_ms, int max_period_ms)
+{
+  if (min_period_ms < 1)
+    min_period_ms = 1;
+  if (max_period_ms < min_period_ms)
+    max_period_ms = min_period_ms;
+
+  ar->min_rate = 1000.0 / max_period_ms;
+  ar->max_rate = 1000.0 / min_period_ms;
+}
+
+adaptive_rate *adaptive_new(int min_period_ms, int max_period_ms)
+{
+  adaptive_rate *ar = calloc(1, sizeof(adaptive_rate));
+
+  if (ar == NULL)
+    return NULL;
+
+  pthread_mutex_init(&ar->lock, NULL);
+  ar->members = 1;
+  set_bounds(ar, min_period_ms, max_period_ms);
+
+  // Start at the conservative end and earn our way up
+  ar->rate = ar->min_rate;
+
+  return ar;
+}
+
+// Another node on the same endpoint. Keep the most conservative bounds:
+// the slowest fastest rate and the slowest slowest rate of all members
+void adaptive_join(adaptive_rate *ar, int min_period_ms, int max_period_ms)
+{
+  adaptive_rate bounds;
+
+  set_bounds(&bounds, min_period_ms, max_period_ms);
+
+  pthread_mutex_lock(&ar->lock);
+  ar->members++;
+  ar->min_rate = fmin(ar->min_rate, bounds.min_rate);
+  ar->max_rate = fmin(ar->max_rate, bounds.max_rate);
+  if (ar->max_rate < ar->min_rate)
+    ar->max_rate = ar->min_rate;
+  ar->rate = ar->min_rate;
+  pthread_mutex_unlock(&ar->lock);
+}
+
+static int period_ms(const adaptive_rate *ar)
+{
+  return (int)lround(1000.0 / ar->rate);
+}
+
+// Feed in the result of one poll cycle and return the new period. Errors
+// and timeouts halve the rate, rising latency backs off gently, otherwise
+// the rate creeps up. Every member feeds in its cycles, so each one only
+// earns its share of the increase
+int adaptive_update(adaptive_rate *ar, bool ok, int64_t latency_us)
+{
+  int period;
+
+  pthread_mutex_lock(&ar->lock);
+  ar->polls++;
+
+  if (!ok)
+  {
+    ar->errors++;
+    ar->rate /= 2;
+  }
+  else
+  {
+    if (ar->polls - ar->errors == 1)
+    {
+      ar->latency_us = ar->baseline_us = latency_us;
+    }
+    else
+    {
+      ar->latency_us += (latency_us - ar->latency_us) / 8;
+
+      // Follow improvements at once, let the baseline drift up slowly so a
+      // single lucky sample doesn't pin it forever
+      if (latency_us < ar->baseline_us)
+        ar->baseline_us = latency_us;
+      else
+        ar->baseline_us += (latency_us - ar->baseline_us) / 256;
+    }
+
+    if (ar->latency_us > ar->baseline_us * CONGESTION_FACTOR + CONGESTION_SLACK_US)
+      ar->rate *= 0.75;
+    else
+      ar->rate += (ar->max_rate - ar->min_rate) / AIMD_STEPS / ar->members;
+  }
+
+  ar->rate = fmax(ar->min_rate, fmin(ar->max_rate, ar->rate));
+  period = period_ms(ar);
+  pthread_mutex_unlock(&ar->lock);
+
+  return period;
+}
+
+int adaptive_period_ms(adaptive_rate *ar)
+{
+  int period;
+
+  pthread_mutex_lock(&ar->lock);
+  period = period_ms(ar);
+  pthread_mutex_unlock(&ar->lock);
+
+  return period;
+}
@@ -0,0 +1,24 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// AIMD rate controller, polls per second between min and max period.
+// Shared by every adaptive node on the same ipaddress:port, so slaves
+// behind one gateway back off together
+typedef struct adaptive_rate
+{
+  pthread_mutex_t lock;
+  int members;
+  double min_rate;
+  double max_rate;
+  double rate;
+  double latency_us;
+  double baseline_us;
+  uint64_t polls;
+  uint64_t errors;
+} adaptive_rate;
+
+adaptive_rate *adaptive_new(int min_period_ms, int max_period_ms);
+void adaptive_join(adaptive_rate *ar, int min_period_ms, int max_period_ms);
+int adaptive_update(adaptive_rate *ar, bool ok, int64_t latency_us);
+int adaptive_period_ms(adaptive_rate *ar);
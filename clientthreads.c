@@ -9,8 +9,34 @@
 #include <signal.h>
 #include <math.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include "clientthreads.h"
+#include "realtime.h"
+
+// Show the current poll period in the node's period_register, if it has one
+static void publish_period(client_config *thisclient, int period_ms)
+{
+  if (thisclient->period_register >= 0)
+    mb_mapping->tab_input_registers[thisclient->period_register] = period_ms > UINT16_MAX ? UINT16_MAX : period_ms;
+}
+
+// Feed one cycle into the adaptive controller and return the new period
+static int steer_rate(client_config *thisclient, bool ok, int64_t latency_us, int period_ms)
+{
+  adaptive_rate *rate = thisclient->rate;
+  int last_period_ms = period_ms;
+
+  period_ms = adaptive_update(rate, ok, latency_us);
+
+  if ((thisclient->debug > 2) && (period_ms != last_period_ms))
+    printf("%s: period %dms, cycle %lldus, %llu/%llu polls failed\n", thisclient->name, period_ms,
+      (long long)latency_us, (unsigned long long)rate->errors, (unsigned long long)rate->polls);
+
+  publish_period(thisclient, period_ms);
+
+  return period_ms;
+}
 
 void *poll_station(void *client_struct)
 {
@@ -23,9 +49,18 @@ void *poll_station(void *client_struct)
   uint16_t tab_input_registers[50];
   uint16_t tab_registers[50], tab_registers_slave[50]={0}, tab_registers_master[50]={0};
   bool connection_live = false;
+  struct timespec next_poll, poll_start;
+  bool polled = false;
+  rt_jitter jitter = {0};
+  int period_ms;
 
   client_config thisclient = *((client_config*)client_struct);
 
+  rt_set_thread(thisclient.name, thisclient.rt_cpu, thisclient.rt_priority);
+  period_ms = thisclient.adaptive ? adaptive_period_ms(thisclient.rate) : thisclient.poll_delay * 1000;
+  publish_period(&thisclient, period_ms);
+  rt_prefault_stack();
+
   if (thisclient.debug)
     printf("Poll thread starting for %s: %s:%s at offset %d, slave #%d\n",thisclient.name,thisclient.ipaddress,thisclient.port,thisclient.offset,thisclient.slaveid);
 
@@ -37,9 +72,28 @@ void *poll_station(void *client_struct)
 
   modbus_set_slave(mb_poll,thisclient.slaveid);
 
+  clock_gettime(CLOCK_MONOTONIC, &next_poll);
+
   while(1)
   {
 
+    // Let the previous poll cycle steer the rate for adaptive nodes
+    if (thisclient.adaptive && polled)
+      period_ms = steer_rate(&thisclient, connection_live, rt_elapsed_us(&poll_start), period_ms);
+
+    // Release any upstream replies waiting on this cycle
+    if (thisclient.state && polled)
+      ondemand_done(thisclient.state, connection_live);
+    polled = false;
+
+    // Wait before (re)connecting so a fresh connection is polled at once.
+    // Lazy nodes idle at the background rate until the server loop wants data
+    if (thisclient.state)
+      ondemand_wait(thisclient.state, &next_poll, period_ms, &jitter);
+    else
+      rt_wait_period(&next_poll, period_ms, &jitter);
+    rt_jitter_report(thisclient.name, &jitter, thisclient.jitter_report);
+
 	// Break connection if persistence is not set
 	if (!thisclient.persistent)
 	{
@@ -59,13 +113,24 @@ void *poll_station(void *client_struct)
 		  if (!thisclient.persistent)
 		  	perror("Connection broken, reconnecting");
 
-          sleep(thisclient.poll_delay);
+          // A failed connect counts against the rate like any failed cycle
+          if (thisclient.adaptive)
+            period_ms = steer_rate(&thisclient, false, 0, period_ms);
+
+          // Don't keep upstream replies waiting on a device we can't reach
+          if (thisclient.state)
+            ondemand_done(thisclient.state, false);
+
+          // Reconnect attempts hold up the schedule, restart it from now
+          clock_gettime(CLOCK_MONOTONIC, &next_poll);
+          rt_wait_period(&next_poll, period_ms, NULL);
       }
     }
 
     connection_live = true;
 
-    sleep(thisclient.poll_delay);
+    clock_gettime(CLOCK_MONOTONIC, &poll_start);
+    polled = true;
 
     if (thisclient.debug > 3)
       printf("Poll %s\n",thisclient.name);
@@ -74,12 +139,12 @@ void *poll_station(void *client_struct)
     // Push_only mode just writes the coils
     if ((thisclient.coil_push_only)&&(thisclient.coil_num > 0))
     {
-      modbus_write_bits(mb_poll, thisclient.coil_start, thisclient.coil_num,&mb_mapping->tab_bits[thisclient.offset]);
+      rec_write_bits(thisclient.rec, mb_poll, thisclient.coil_start, thisclient.coil_num,&mb_mapping->tab_bits[thisclient.offset]);
     }
     else if (thisclient.coil_num > 0)
     {
       // Read coil bits
-      if (modbus_read_bits(mb_poll, thisclient.coil_start, thisclient.coil_num, tab_bits) == -1)
+      if (rec_read_bits(thisclient.rec, mb_poll, thisclient.coil_start, thisclient.coil_num, tab_bits) == -1)
       {
         connection_live = false;
         continue;
@@ -132,7 +197,7 @@ void *poll_station(void *client_struct)
             if (master_changes[i])
             {
               tab_bits_slave[i] = mb_mapping->tab_bits[thisclient.offset+i];
-              modbus_write_bit(mb_poll, thisclient.coil_start + i,mb_mapping->tab_bits[thisclient.offset+i]);
+              rec_write_bit(thisclient.rec, mb_poll, thisclient.coil_start + i,mb_mapping->tab_bits[thisclient.offset+i]);
             }
           }
 
@@ -165,7 +230,7 @@ void *poll_station(void *client_struct)
     // Handle discrete inputs, read only
     if (thisclient.input_num > 0)
     {
-      if(modbus_read_input_bits(mb_poll, thisclient.input_start, thisclient.input_num, tab_input_bits) == -1)
+      if(rec_read_input_bits(thisclient.rec, mb_poll, thisclient.input_start, thisclient.input_num, tab_input_bits) == -1)
       {
         connection_live = false;
         continue;
@@ -190,7 +255,7 @@ void *poll_station(void *client_struct)
     // Handle input registers, read only
     if (thisclient.ir_num > 0)
     {
-      if (modbus_read_input_registers(mb_poll, thisclient.ir_start, thisclient.ir_num, tab_input_registers) == -1)
+      if (rec_read_input_registers(thisclient.rec, mb_poll, thisclient.ir_start, thisclient.ir_num, tab_input_registers) == -1)
       {
         connection_live = false;
         continue;
@@ -207,12 +272,12 @@ void *poll_station(void *client_struct)
     // Push_only mode just writes the registers
     if ((thisclient.hr_push_only)&&(thisclient.hr_num > 0))
     {
-      modbus_write_registers(mb_poll, thisclient.hr_start, thisclient.hr_num, &mb_mapping->tab_registers[thisclient.offset]);
+      rec_write_registers(thisclient.rec, mb_poll, thisclient.hr_start, thisclient.hr_num, &mb_mapping->tab_registers[thisclient.offset]);
     }
     else if (thisclient.hr_num > 0)
     {
       // Read holding registers
-      if(modbus_read_registers(mb_poll, thisclient.hr_start, thisclient.hr_num, tab_registers) == -1)
+      if(rec_read_registers(thisclient.rec, mb_poll, thisclient.hr_start, thisclient.hr_num, tab_registers) == -1)
       {
         connection_live = false;
         continue;
@@ -251,7 +316,7 @@ void *poll_station(void *client_struct)
             if (master_changes[i])
             {
               tab_registers_slave[i] = mb_mapping->tab_registers[thisclient.offset+i];
-              modbus_write_register(mb_poll, thisclient.hr_start+i,mb_mapping->tab_registers[thisclient.offset+i]);
+              rec_write_register(thisclient.rec, mb_poll, thisclient.hr_start+i,mb_mapping->tab_registers[thisclient.offset+i]);
             }
           }
       } else if (slave_changed)
@@ -2,6 +2,10 @@
 #include <pthread.h>
 #include <stdbool.h>
 
+#include "record.h"
+#include "ondemand.h"
+#include "adaptive.h"
+
 extern modbus_mapping_t *mb_mapping;
 
 typedef struct client_config
@@ -27,6 +31,18 @@ typedef struct client_config
   bool hr_push_only;
   bool hr_dir_mask;
   bool persistent;
+  bool adaptive;
+  int min_period_ms;
+  int max_period_ms;
+  int period_register;
+  adaptive_rate *rate;
+  int rt_cpu;
+  int rt_priority;
+  int jitter_report;
+  recorder *rec;
+  int max_age_ms;
+  int hold_ms;
+  node_state *state;
 } client_config;
 
 void *poll_station(void *client_struct);
@@ -35,9 +35,11 @@
 
 #define NB_CONNECTION    INT_MAX
 #define THREADPOOL  100
+#define LAZY_POLL_DELAY 60
 
 #include "clientthreads.h"
 #include "modbus-agg.h"
+#include "realtime.h"
 
 
 // Modbus globals
@@ -49,11 +51,13 @@ int main(int argc, char **argv) {
 
     // Thread pool
     pthread_t pollthread[THREADPOOL];
+    pthread_attr_t pollattr;
 
     // Modbus server vars
     uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
     int master_socket;
     int rc;
+    int header_length;
     fd_set refset;
     fd_set rdset;
     int fdmax;
@@ -68,11 +72,13 @@ int main(int argc, char **argv) {
     config_t cfg;
     config_setting_t *setting;
     const char *c_ip_addr = NULL;
+    const char *c_record_dir = NULL;
     int c_port = 0;
     int node_count = 0;
     client_config *nodesetup[THREADPOOL];
     int debug_level = 1;
     int largest_coil = 0, largest_input = 0, largest_hr = 0, largest_ir = 0;
+    rt_config rt;
 
     // Libconfig section
     config_init(&cfg);
@@ -99,6 +105,53 @@ int main(int argc, char **argv) {
       printf("Config file: listening port %d\n",c_port);
     }
 
+    // Record every downstream request/response into <record_dir>/<node>.rec
+    if (config_lookup_string(&cfg,"record_dir",&c_record_dir))
+    {
+      printf("Config file: recording traffic to %s\n",c_record_dir);
+    }
+
+    // Optional realtime section: CPU pinning, SCHED_FIFO and memory locking
+    rt_config_defaults(&rt);
+    setting = config_lookup(&cfg, "realtime");
+
+    if (setting != NULL)
+    {
+      int c_lock_memory = 0;
+      config_setting_t *cpus;
+
+      config_setting_lookup_bool(setting, "lock_memory", &c_lock_memory);
+      rt.lock_memory = c_lock_memory;
+      config_setting_lookup_int(setting, "stack_kb", &rt.stack_kb);
+      if (rt.stack_kb < rt_min_stack_kb())
+      {
+        fprintf(stderr, "Config file: stack_kb %d is too small, using %d\n", rt.stack_kb, rt_min_stack_kb());
+        rt.stack_kb = rt_min_stack_kb();
+      }
+      config_setting_lookup_int(setting, "server_cpu", &rt.server_cpu);
+      config_setting_lookup_int(setting, "server_priority", &rt.server_priority);
+      config_setting_lookup_int(setting, "poll_priority", &rt.poll_priority);
+      config_setting_lookup_int(setting, "jitter_report", &rt.jitter_report);
+
+      // Poll threads are dealt out round robin across the listed CPUs
+      cpus = config_setting_get_member(setting, "poll_cpus");
+      if (cpus != NULL)
+      {
+        rt.poll_cpu_count = config_setting_length(cpus);
+        if (rt.poll_cpu_count > RT_MAX_CPUS)
+          rt.poll_cpu_count = RT_MAX_CPUS;
+        for (int i = 0; i < rt.poll_cpu_count; i++)
+          rt.poll_cpus[i] = config_setting_get_int_elem(cpus, i);
+      }
+
+      if (debug_level)
+      {
+        printf("Config file: realtime, memory %s, server cpu %d prio %d, poll prio %d on %d cpus\n",
+          rt.lock_memory ? "locked" : "unlocked", rt.server_cpu, rt.server_priority,
+          rt.poll_priority, rt.poll_cpu_count);
+      }
+    }
+
     // Parse node list
     setting = config_lookup(&cfg, "nodes");
 
@@ -132,6 +185,9 @@ int main(int argc, char **argv) {
         int c_coil_dir_mask = 0, c_hr_dir_mask = 0;
         int c_debug = 0, c_mirror_coils = 0;
 		int c_persistent = 0;
+        int c_adaptive = 0, c_min_period_ms = 100, c_max_period_ms = 0;
+        int c_period_register = -1;
+        int c_max_age_ms = 0, c_hold_ms = 0;
 
         config_setting_t *node = config_setting_get_elem(setting, i);
         config_setting_lookup_string(node, "name", &c_name);
@@ -162,6 +218,33 @@ int main(int argc, char **argv) {
 
 		config_setting_lookup_bool(node, "persistent", &c_persistent);
 
+        // Lazy nodes poll every poll_delay in the background, and on demand
+        // when an upstream read finds their data older than max_age_ms
+        config_setting_lookup_int(node, "max_age_ms", &c_max_age_ms);
+        config_setting_lookup_int(node, "hold_ms", &c_hold_ms);
+
+        // Without a background period a lazy node would poll flat out
+        if ((c_max_age_ms > 0) && (c_poll_delay <= 0))
+        {
+          printf("%s: lazy node has no poll_delay, polling every %ds in the background\n",c_name,LAZY_POLL_DELAY);
+          c_poll_delay = LAZY_POLL_DELAY;
+        }
+
+        // Adaptive nodes float between min and max period, max defaults to poll_delay
+        config_setting_lookup_bool(node, "adaptive", &c_adaptive);
+        config_setting_lookup_int(node, "min_period_ms", &c_min_period_ms);
+        if (!config_setting_lookup_int(node, "max_period_ms", &c_max_period_ms))
+          c_max_period_ms = c_poll_delay > 0 ? c_poll_delay * 1000 : 1000;
+        config_setting_lookup_int(node, "period_register", &c_period_register);
+
+        // Adapting would speed a lazy node's background polling up to
+        // min_period_ms, which defeats max_age_ms, so lazy wins
+        if ((c_adaptive) && (c_max_age_ms > 0))
+        {
+          printf("%s: adaptive is ignored on lazy nodes with max_age_ms\n",c_name);
+          c_adaptive = 0;
+        }
+
         if (debug_level)
         {
           printf("Node %d: %s\n",i,c_name);
@@ -177,6 +260,12 @@ int main(int argc, char **argv) {
             printf("%d Holding regs: %d - %d mapped to %d - %d\n",c_hr_num,c_hr_start,c_hr_start+c_hr_num-1,c_hr_start+c_offset,c_hr_start+c_hr_num+c_offset-1);
           if (c_ir_num)
           printf("%d Input regs: %d - %d mapped to %d - %d\n",c_ir_num,c_ir_start,c_ir_start+c_ir_num-1,c_ir_start+c_offset,c_ir_start+c_ir_num+c_offset-1);
+          if (c_adaptive)
+            printf("Adaptive polling every %d - %dms\n",c_min_period_ms,c_max_period_ms);
+          if (c_max_age_ms)
+            printf("On demand refresh when older than %dms, holding replies up to %dms\n",c_max_age_ms,c_hold_ms);
+          if (c_period_register >= 0)
+            printf("Effective poll period at input reg %d\n",c_period_register);
           printf("Connection live bit at input %d\n\n",c_input_start+c_input_num+c_offset+(c_coil_num*c_mirror_coils));
         }
 
@@ -185,6 +274,7 @@ int main(int argc, char **argv) {
         largest_input = max(largest_input, c_input_start+c_input_num+c_offset+(c_coil_num*c_mirror_coils)+1);
         largest_hr = max(largest_hr,c_hr_start+c_hr_num+c_offset);
         largest_ir = max(largest_ir,c_ir_start+c_ir_num+c_offset);
+        largest_ir = max(largest_ir,c_period_register+1);
 
         nodesetup[i] = malloc(sizeof(client_config));
 
@@ -215,6 +305,42 @@ int main(int argc, char **argv) {
         nodesetup[i]->mirror_coils = c_mirror_coils;
 
         nodesetup[i]->persistent = c_persistent;
+
+        nodesetup[i]->adaptive = c_adaptive;
+        nodesetup[i]->min_period_ms = c_min_period_ms;
+        nodesetup[i]->max_period_ms = c_max_period_ms;
+        nodesetup[i]->period_register = c_period_register;
+
+        // One controller per ipaddress:port, so slaves behind the same
+        // gateway share its latency and error history
+        nodesetup[i]->rate = NULL;
+        for (int j = 0; (j < i) && c_adaptive && (nodesetup[i]->rate == NULL); j++)
+        {
+          if ((nodesetup[j]->rate != NULL) && (strcmp(nodesetup[j]->ipaddress, nodesetup[i]->ipaddress) == 0)
+            && (strcmp(nodesetup[j]->port, nodesetup[i]->port) == 0))
+          {
+            nodesetup[i]->rate = nodesetup[j]->rate;
+            adaptive_join(nodesetup[i]->rate, c_min_period_ms, c_max_period_ms);
+          }
+        }
+        if (c_adaptive && (nodesetup[i]->rate == NULL))
+          nodesetup[i]->rate = adaptive_new(c_min_period_ms, c_max_period_ms);
+
+        nodesetup[i]->max_age_ms = c_max_age_ms;
+        nodesetup[i]->hold_ms = c_hold_ms;
+        nodesetup[i]->state = (c_max_age_ms > 0) ? ondemand_state_new() : NULL;
+
+        nodesetup[i]->rec = NULL;
+        if (c_record_dir != NULL)
+        {
+          nodesetup[i]->rec = rec_open(c_record_dir, c_name, c_slaveid);
+          if (nodesetup[i]->rec == NULL)
+            return -1;
+        }
+
+        nodesetup[i]->rt_cpu = rt.poll_cpu_count ? rt.poll_cpus[i % rt.poll_cpu_count] : -1;
+        nodesetup[i]->rt_priority = rt.poll_priority;
+        nodesetup[i]->jitter_report = rt.jitter_report;
       }
 
       node_count = count;
@@ -285,6 +411,7 @@ int main(int argc, char **argv) {
     printf("Listening on %s:%d \n", ip_addr, mb_port);
 
     ctx = modbus_new_tcp(ip_addr, mb_port);
+    header_length = modbus_get_header_length(ctx);
 
     // Allocate main modbus map
     if (debug_level > 1)
@@ -302,6 +429,25 @@ int main(int argc, char **argv) {
         return -1;
     }
 
+    // Map addresses back to lazy nodes so reads can trigger a refresh
+    if (ondemand_init(nodesetup, node_count, mb_mapping) != 0) {
+        fprintf(stderr, "Failed to allocate the on demand lookup\n");
+        return -1;
+    }
+
+    // Lock the mapping and everything allocated so far, plus all future
+    // thread stacks, into RAM before any polling starts
+    pthread_attr_init(&pollattr);
+    if (rt.lock_memory)
+    {
+      if (rt_lock_memory() == 0 && debug_level > 1)
+        printf("Memory locked\n");
+
+      // Locked stacks are fully resident, so keep them small
+      if ((rc = pthread_attr_setstacksize(&pollattr, (size_t)rt.stack_kb * 1024)) != 0)
+        fprintf(stderr, "Cannot set poll thread stack to %dkB: %s\n", rt.stack_kb, strerror(rc));
+    }
+
     server_socket = modbus_tcp_listen(ctx, NB_CONNECTION);
 
     signal(SIGINT, close_sigint);
@@ -320,11 +466,15 @@ int main(int argc, char **argv) {
       if (debug_level > 1)
         fprintf(stderr, "Creating poll thread %d\n", i);
 
-      if(pthread_create(&pollthread[i], NULL, poll_station, nodesetup[i])){
+      if(pthread_create(&pollthread[i], &pollattr, poll_station, nodesetup[i])){
         fprintf(stderr, "Poll thread %d creation failed\n", i);
       }
     }
 
+    // Poll threads inherit affinity and policy from us, so only tune the
+    // server loop once they have all been started
+    rt_set_thread("Server", rt.server_cpu, rt.server_priority);
+
 // MAIN SERVER LOOP
     for (;;) {
 
@@ -370,7 +520,9 @@ int main(int argc, char **argv) {
                 modbus_set_socket(ctx, master_socket);
                 rc = modbus_receive(ctx, query);
                 if (rc > 0) {
+                    ondemand_request(query, header_length);
                     modbus_reply(ctx, query, rc, mb_mapping);
+                    ondemand_write(query, header_length);
                 } else if (rc == -1) {
                     /* This example server in ended on connection closing or
                      * any errors. */
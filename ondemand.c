@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "clientthreads.h"
+#include "realtime.h"
+
+enum { TABLE_COILS, TABLE_INPUTS, TABLE_HR, TABLE_IR, TABLES };
+
+// Main map address -> index of the lazy node that owns it, -1 for none
+static int16_t *owner[TABLES];
+static int owner_size[TABLES];
+static client_config **lazy_nodes;
+
+// Scratch space for ondemand_request, only ever used from the server loop
+static bool *seen;
+static bool *stale;
+static int *touched;
+static uint64_t *cycle;
+
+node_state *ondemand_state_new(void)
+{
+  node_state *state = calloc(1, sizeof(node_state));
+  pthread_condattr_t attr;
+
+  if (state == NULL)
+    return NULL;
+
+  // Poll schedules are on the monotonic clock, so wait on it too
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&state->lock, NULL);
+  pthread_cond_init(&state->wake, &attr);
+  pthread_cond_init(&state->updated, &attr);
+  pthread_condattr_destroy(&attr);
+
+  return state;
+}
+
+// Poll thread side: idle until the next background poll unless the server
+// loop asks for fresh data first
+void ondemand_wait(node_state *state, struct timespec *next_poll, int period_ms, struct rt_jitter *jitter)
+{
+  int rc = 0;
+
+  rt_schedule_next(next_poll, period_ms, jitter);
+
+  pthread_mutex_lock(&state->lock);
+  while ((!state->refresh) && (rc != ETIMEDOUT))
+    rc = pthread_cond_timedwait(&state->wake, &state->lock, next_poll);
+
+  if (state->refresh)
+  {
+    // Background polls count on from the last on demand one
+    state->refresh = false;
+    clock_gettime(CLOCK_MONOTONIC, next_poll);
+  }
+  else if (jitter)
+  {
+    rt_jitter_sample(jitter, next_poll);
+  }
+
+  state->polling = true;
+  pthread_mutex_unlock(&state->lock);
+}
+
+// Poll thread side: a cycle finished, release any replies held for it
+// whether or not it got fresh data, so a dead device can't stall them
+void ondemand_done(node_state *state, bool fresh)
+{
+  pthread_mutex_lock(&state->lock);
+  state->polling = false;
+  state->cycles++;
+  state->down = !fresh;
+  if (fresh)
+    clock_gettime(CLOCK_MONOTONIC, &state->last_update);
+  pthread_cond_broadcast(&state->updated);
+  pthread_mutex_unlock(&state->lock);
+}
+
+static void claim(int table, int start, int num, int node)
+{
+  for (int i = start; (i < start + num) && (i < owner_size[table]); i++)
+    owner[table][i] = node;
+}
+
+// Build the address lookup for nodes with max_age_ms set
+int ondemand_init(client_config **nodes, int node_count, modbus_mapping_t *mapping)
+{
+  int sizes[TABLES] = { mapping->nb_bits, mapping->nb_input_bits, mapping->nb_registers, mapping->nb_input_registers };
+  bool any = false;
+
+  for (int n = 0; n < node_count; n++)
+    any |= (nodes[n]->state != NULL);
+
+  if (!any)
+    return 0;
+
+  for (int t = 0; t < TABLES; t++)
+  {
+    owner[t] = malloc(sizes[t] * sizeof(int16_t));
+    if (owner[t] == NULL)
+      return -1;
+    owner_size[t] = sizes[t];
+    for (int i = 0; i < sizes[t]; i++)
+      owner[t][i] = -1;
+  }
+
+  seen = calloc(node_count, sizeof(bool));
+  stale = calloc(node_count, sizeof(bool));
+  touched = calloc(node_count, sizeof(int));
+  cycle = calloc(node_count, sizeof(uint64_t));
+  if ((seen == NULL) || (stale == NULL) || (touched == NULL) || (cycle == NULL))
+    return -1;
+
+  for (int n = 0; n < node_count; n++)
+  {
+    client_config *node = nodes[n];
+
+    if (node->state == NULL)
+      continue;
+
+    claim(TABLE_COILS, node->offset, node->coil_num, n);
+    claim(TABLE_INPUTS, node->offset, node->input_num + (node->coil_num * node->mirror_coils), n);
+    claim(TABLE_HR, node->offset, node->hr_num, n);
+    claim(TABLE_IR, node->offset, node->ir_num, n);
+  }
+
+  lazy_nodes = nodes;
+  return 0;
+}
+
+// Ask for a refresh if the node's data is older than max_age_ms.
+// Returns true if the data was stale, with the cycle count to wait past
+static bool trigger(client_config *node, uint64_t *cycle)
+{
+  node_state *state = node->state;
+  bool stale;
+
+  pthread_mutex_lock(&state->lock);
+  stale = rt_elapsed_us(&state->last_update) > (int64_t)node->max_age_ms * 1000;
+  if ((stale) && (!state->polling) && (!state->refresh))
+  {
+    state->refresh = true;
+    pthread_cond_signal(&state->wake);
+  }
+  *cycle = state->cycles;
+  pthread_mutex_unlock(&state->lock);
+
+  return stale;
+}
+
+// Hold the reply until the node finishes its next poll, or hold_ms runs out.
+// A node whose last cycle failed isn't worth waiting for
+static void hold(client_config *node, uint64_t cycle, const struct timespec *received)
+{
+  node_state *state = node->state;
+  struct timespec deadline = *received;
+  int rc = 0;
+
+  deadline.tv_sec += node->hold_ms / 1000;
+  deadline.tv_nsec += (long)(node->hold_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&state->lock);
+  while ((state->cycles == cycle) && (!state->down) && (rc != ETIMEDOUT))
+    rc = pthread_cond_timedwait(&state->updated, &state->lock, &deadline);
+  pthread_mutex_unlock(&state->lock);
+}
+
+// Server loop side: look up which lazy nodes a read, or the read half of a
+// write and read, touches and refresh any that are stale before the reply
+// is built
+void ondemand_request(const uint8_t *query, int header_length)
+{
+  int function = query[header_length];
+  int table, addr, end;
+  int count = 0;
+  struct timespec received;
+
+  if (lazy_nodes == NULL)
+    return;
+
+  switch (function)
+  {
+    case MODBUS_FC_READ_COILS:
+      table = TABLE_COILS;
+      break;
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+      table = TABLE_INPUTS;
+      break;
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+      table = TABLE_HR;
+      break;
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+      table = TABLE_IR;
+      break;
+    default:
+      return;
+  }
+
+  addr = (query[header_length+1] << 8) | query[header_length+2];
+  end = addr + ((query[header_length+3] << 8) | query[header_length+4]);
+  if (end > owner_size[table])
+    end = owner_size[table];
+
+  clock_gettime(CLOCK_MONOTONIC, &received);
+
+  for (int a = addr; a < end; a++)
+  {
+    int n = owner[table][a];
+
+    if ((n < 0) || (seen[n]))
+      continue;
+    seen[n] = true;
+
+    stale[count] = trigger(lazy_nodes[n], &cycle[count]);
+    touched[count++] = n;
+  }
+
+  // All refreshes are under way before we wait on any of them
+  for (int i = 0; i < count; i++)
+  {
+    client_config *node = lazy_nodes[touched[i]];
+
+    seen[touched[i]] = false;
+    if ((stale[i]) && (node->hold_ms > 0))
+      hold(node, cycle[i], &received);
+  }
+}
+
+// Server loop side, after the reply: a master wrote into a lazy node's
+// coils or holding registers, so poll now to push it out rather than
+// leaving it for the next background poll. A poll already running may
+// have read the old values, so this asks for one more after it
+void ondemand_write(const uint8_t *query, int header_length)
+{
+  int function = query[header_length];
+  int table, addr, end, last = -1;
+
+  if (lazy_nodes == NULL)
+    return;
+
+  addr = (query[header_length+1] << 8) | query[header_length+2];
+
+  switch (function)
+  {
+    case MODBUS_FC_WRITE_SINGLE_COIL:
+      table = TABLE_COILS;
+      end = addr + 1;
+      break;
+    case MODBUS_FC_WRITE_SINGLE_REGISTER:
+      table = TABLE_HR;
+      end = addr + 1;
+      break;
+    case MODBUS_FC_WRITE_MULTIPLE_COILS:
+      table = TABLE_COILS;
+      end = addr + ((query[header_length+3] << 8) | query[header_length+4]);
+      break;
+    case MODBUS_FC_WRITE_MULTIPLE_REGISTERS:
+      table = TABLE_HR;
+      end = addr + ((query[header_length+3] << 8) | query[header_length+4]);
+      break;
+    case MODBUS_FC_WRITE_AND_READ_REGISTERS:
+      // The write half follows the read address and count
+      table = TABLE_HR;
+      addr = (query[header_length+5] << 8) | query[header_length+6];
+      end = addr + ((query[header_length+7] << 8) | query[header_length+8]);
+      break;
+    default:
+      return;
+  }
+
+  if (end > owner_size[table])
+    end = owner_size[table];
+
+  for (int a = addr; a < end; a++)
+  {
+    int n = owner[table][a];
+    node_state *state;
+
+    if ((n < 0) || (n == last))
+      continue;
+    last = n;
+
+    state = lazy_nodes[n]->state;
+    pthread_mutex_lock(&state->lock);
+    state->refresh = true;
+    pthread_cond_signal(&state->wake);
+    pthread_mutex_unlock(&state->lock);
+  }
+}
@@ -0,0 +1,29 @@
+#include <modbus.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+struct client_config;
+struct rt_jitter;
+
+// Shared between a lazy node's poll thread and the server loop
+typedef struct node_state
+{
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t updated;
+  bool refresh;
+  bool polling;
+  bool down;
+  uint64_t cycles;
+  struct timespec last_update;
+} node_state;
+
+node_state *ondemand_state_new(void);
+void ondemand_wait(node_state *state, struct timespec *next_poll, int period_ms, struct rt_jitter *jitter);
+void ondemand_done(node_state *state, bool fresh);
+
+int ondemand_init(struct client_config **nodes, int node_count, modbus_mapping_t *mapping);
+void ondemand_request(const uint8_t *query, int header_length);
+void ondemand_write(const uint8_t *query, int header_length);
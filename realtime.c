@@ -0,0 +1,226 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "realtime.h"
+
+// Upper edge of each jitter bucket in microseconds, last bucket is open ended
+static const uint64_t bucket_edges[RT_JITTER_BUCKETS-1] =
+  {10, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 50000, 100000};
+
+void rt_config_defaults(rt_config *rt)
+{
+  memset(rt, 0, sizeof(*rt));
+  rt->stack_kb = 256;
+  rt->server_cpu = -1;
+}
+
+// Smallest usable poll thread stack: room for the prefault plus the poll
+// loop, and never below what pthreads will accept
+int rt_min_stack_kb(void)
+{
+  long min_bytes = RT_PREFAULT_STACK + RT_STACK_HEADROOM;
+
+  if ((long)PTHREAD_STACK_MIN > min_bytes)
+    min_bytes = PTHREAD_STACK_MIN;
+
+  return (min_bytes + 1023) / 1024;
+}
+
+// Lock all current and future pages into RAM and stop malloc from handing
+// memory back to the kernel, so the poll and server loops never take a fault
+int rt_lock_memory(void)
+{
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+  {
+    perror("mlockall failed");
+    return -1;
+  }
+
+  rt_prefault_stack();
+  return 0;
+}
+
+// Touch one byte per page, top down the way the stack grows, through a
+// volatile pointer so the stores can't be optimised away
+void rt_prefault_stack(void)
+{
+  unsigned char dummy[RT_PREFAULT_STACK];
+  volatile unsigned char *page = dummy;
+  long page_size = sysconf(_SC_PAGESIZE);
+
+  if (page_size <= 0)
+    page_size = 4096;
+
+  for (long i = RT_PREFAULT_STACK - 1; i >= 0; i -= page_size)
+    page[i] = 0;
+}
+
+// Pin the calling thread to a CPU and/or give it a SCHED_FIFO priority.
+// cpu < 0 leaves affinity alone, priority 0 leaves the default scheduler
+int rt_set_thread(const char *name, int cpu, int priority)
+{
+  int rc = 0;
+
+  if (cpu >= 0)
+  {
+    cpu_set_t cpuset;
+
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset)) != 0)
+    {
+      fprintf(stderr, "%s: cannot pin to CPU %d: %s\n", name, cpu, strerror(errno));
+      rc = -1;
+    }
+  }
+
+  if (priority > 0)
+  {
+    struct sched_param param = { .sched_priority = priority };
+
+    if ((errno = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0)
+    {
+      fprintf(stderr, "%s: cannot set SCHED_FIFO priority %d: %s\n", name, priority, strerror(errno));
+      rc = -1;
+    }
+  }
+
+  return rc;
+}
+
+static void timespec_add_ms(struct timespec *ts, int ms)
+{
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L)
+  {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+static int64_t timespec_diff_us(const struct timespec *a, const struct timespec *b)
+{
+  return (int64_t)(a->tv_sec - b->tv_sec) * 1000000 + (a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+static void jitter_record(rt_jitter *jitter, int64_t late_us)
+{
+  int b = 0;
+
+  if (late_us < 0)
+    late_us = 0;
+
+  while ((b < RT_JITTER_BUCKETS-1) && ((uint64_t)late_us >= bucket_edges[b]))
+    b++;
+
+  jitter->buckets[b]++;
+  jitter->count++;
+  jitter->sum_us += late_us;
+  if ((uint64_t)late_us > jitter->max_us)
+    jitter->max_us = late_us;
+}
+
+// Advance the schedule by one period. If the last poll ran over a whole
+// period, restart the schedule from now rather than firing a burst of back
+// to back polls to catch up. A zero period polls flat out from now on and
+// can't overrun
+void rt_schedule_next(struct timespec *next_poll, int period_ms, rt_jitter *jitter)
+{
+  struct timespec now;
+
+  if (period_ms <= 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, next_poll);
+    return;
+  }
+
+  timespec_add_ms(next_poll, period_ms);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (timespec_diff_us(&now, next_poll) > (int64_t)period_ms * 1000)
+  {
+    *next_poll = now;
+    if (jitter)
+      jitter->overruns++;
+  }
+}
+
+// Record how late we woke up against the scheduled time
+void rt_jitter_sample(rt_jitter *jitter, const struct timespec *scheduled)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  jitter_record(jitter, timespec_diff_us(&now, scheduled));
+}
+
+// Sleep until the next absolute poll time so the period doesn't drift by
+// the time the poll itself took
+void rt_wait_period(struct timespec *next_poll, int period_ms, rt_jitter *jitter)
+{
+  rt_schedule_next(next_poll, period_ms, jitter);
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next_poll, NULL) == EINTR);
+
+  if (jitter)
+    rt_jitter_sample(jitter, next_poll);
+}
+
+int64_t rt_elapsed_us(const struct timespec *since)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return timespec_diff_us(&now, since);
+}
+
+// Print the histogram if interval seconds have passed since the last report
+void rt_jitter_report(const char *name, rt_jitter *jitter, int interval)
+{
+  char line[512];
+  int len;
+  struct timespec now;
+
+  if ((interval <= 0) || (jitter->count == 0))
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (jitter->last_report.tv_sec == 0)
+  {
+    jitter->last_report = now;
+    return;
+  }
+  if (now.tv_sec - jitter->last_report.tv_sec < interval)
+    return;
+  jitter->last_report = now;
+
+  len = snprintf(line, sizeof(line), "%s jitter: %llu polls, %llu overruns, avg %lluus, max %lluus |",
+    name, (unsigned long long)jitter->count, (unsigned long long)jitter->overruns,
+    (unsigned long long)(jitter->sum_us / jitter->count), (unsigned long long)jitter->max_us);
+
+  for (int b = 0; (b < RT_JITTER_BUCKETS) && (len < (int)sizeof(line)); b++)
+  {
+    if (b < RT_JITTER_BUCKETS-1)
+      len += snprintf(line+len, sizeof(line)-len, " <%llu:%llu",
+        (unsigned long long)bucket_edges[b], (unsigned long long)jitter->buckets[b]);
+    else
+      len += snprintf(line+len, sizeof(line)-len, " >=%llu:%llu",
+        (unsigned long long)bucket_edges[b-1], (unsigned long long)jitter->buckets[b]);
+  }
+
+  // One write per report so lines from different poll threads don't interleave
+  printf("%s\n", line);
+}
@@ -0,0 +1,45 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define RT_MAX_CPUS 64
+#define RT_JITTER_BUCKETS 12
+
+// Bytes of stack touched up front so later growth never faults
+#define RT_PREFAULT_STACK (64*1024)
+// Stack left over for the poll loop itself on top of the prefault
+#define RT_STACK_HEADROOM (64*1024)
+
+typedef struct rt_config
+{
+  bool lock_memory;
+  int stack_kb;
+  int server_cpu;
+  int server_priority;
+  int poll_cpus[RT_MAX_CPUS];
+  int poll_cpu_count;
+  int poll_priority;
+  int jitter_report;
+} rt_config;
+
+// Histogram of poll start lateness, scheduled vs actual
+typedef struct rt_jitter
+{
+  uint64_t count;
+  uint64_t overruns;
+  uint64_t sum_us;
+  uint64_t max_us;
+  uint64_t buckets[RT_JITTER_BUCKETS];
+  struct timespec last_report;
+} rt_jitter;
+
+void rt_config_defaults(rt_config *rt);
+int rt_min_stack_kb(void);
+int rt_lock_memory(void);
+void rt_prefault_stack(void);
+int rt_set_thread(const char *name, int cpu, int priority);
+void rt_schedule_next(struct timespec *next_poll, int period_ms, rt_jitter *jitter);
+void rt_jitter_sample(rt_jitter *jitter, const struct timespec *scheduled);
+void rt_wait_period(struct timespec *next_poll, int period_ms, rt_jitter *jitter);
+int64_t rt_elapsed_us(const struct timespec *since);
+void rt_jitter_report(const char *name, rt_jitter *jitter, int interval);
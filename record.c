@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <limits.h>
+
+#include "record.h"
+
+#define REC_BUFFER (64*1024)
+
+static int64_t elapsed_us(const struct timespec *since, const struct timespec *now)
+{
+  return (int64_t)(now->tv_sec - since->tv_sec) * 1000000 + (now->tv_nsec - since->tv_nsec) / 1000;
+}
+
+// Create <dir>/<name>.rec and write its header
+recorder *rec_open(const char *dir, const char *name, int slaveid)
+{
+  char path[PATH_MAX];
+  rec_header header = {0};
+  recorder *rec;
+  int len;
+
+  len = snprintf(path, sizeof(path), "%s/", dir);
+  for (const char *c = name; *c && (len < (int)sizeof(path)-5); c++)
+    path[len++] = (*c == '/') ? '_' : *c;
+  strcpy(path+len, ".rec");
+
+  rec = calloc(1, sizeof(recorder));
+  if (rec == NULL)
+    return NULL;
+
+  rec->fp = fopen(path, "wb");
+  if (rec->fp == NULL)
+  {
+    fprintf(stderr, "Cannot open recording %s: %s\n", path, strerror(errno));
+    free(rec);
+    return NULL;
+  }
+  setvbuf(rec->fp, NULL, _IOFBF, REC_BUFFER);
+
+  memcpy(header.magic, REC_MAGIC, sizeof(REC_MAGIC));
+  header.version = REC_VERSION;
+  header.slaveid = slaveid;
+  strncpy(header.name, name, sizeof(header.name)-1);
+  fwrite(&header, sizeof(header), 1, rec->fp);
+
+  clock_gettime(CLOCK_MONOTONIC, &rec->start);
+  rec->last_flush = rec->start;
+
+  return rec;
+}
+
+// Append one request/response pair. Bits are packed on the way out
+static void rec_log(recorder *rec, uint8_t function, int addr, int nb, int rc,
+  const struct timespec *sent, const void *data, bool bits)
+{
+  struct timespec now;
+  rec_entry entry;
+  uint8_t packed[MODBUS_MAX_READ_BITS/8];
+  int error = errno;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  entry.time_us = elapsed_us(&rec->start, sent);
+  entry.latency_us = elapsed_us(sent, &now);
+  entry.function = function;
+  entry.failed = (rc == -1);
+  entry.error = entry.failed ? error : 0;
+  entry.addr = addr;
+  entry.count = nb;
+  entry.length = 0;
+
+  if (!entry.failed)
+  {
+    if (bits)
+    {
+      const uint8_t *src = data;
+
+      if (nb > MODBUS_MAX_READ_BITS)
+        nb = entry.count = MODBUS_MAX_READ_BITS;
+      memset(packed, 0, (nb+7)/8);
+      for (int i = 0; i < nb; i++)
+        if (src[i])
+          packed[i/8] |= 1 << (i%8);
+      entry.length = (nb+7)/8;
+      data = packed;
+    }
+    else
+    {
+      entry.length = nb * sizeof(uint16_t);
+    }
+  }
+
+  fwrite(&entry, sizeof(entry), 1, rec->fp);
+  if (entry.length)
+    fwrite(data, entry.length, 1, rec->fp);
+
+  // Keep at most a second of traffic in the buffer
+  if (now.tv_sec != rec->last_flush.tv_sec)
+  {
+    fflush(rec->fp);
+    rec->last_flush = now;
+  }
+}
+
+int rec_read_bits(recorder *rec, modbus_t *ctx, int addr, int nb, uint8_t *dest)
+{
+  struct timespec sent;
+  int rc;
+
+  if (rec == NULL)
+    return modbus_read_bits(ctx, addr, nb, dest);
+
+  clock_gettime(CLOCK_MONOTONIC, &sent);
+  rc = modbus_read_bits(ctx, addr, nb, dest);
+  rec_log(rec, MODBUS_FC_READ_COILS, addr, nb, rc, &sent, dest, true);
+  return rc;
+}
+
+int rec_read_input_bits(recorder *rec, modbus_t *ctx, int addr, int nb, uint8_t *dest)
+{
+  struct timespec sent;
+  int rc;
+
+  if (rec == NULL)
+    return modbus_read_input_bits(ctx, addr, nb, dest);
+
+  clock_gettime(CLOCK_MONOTONIC, &sent);
+  rc = modbus_read_input_bits(ctx, addr, nb, dest);
+  rec_log(rec, MODBUS_FC_READ_DISCRETE_INPUTS, addr, nb, rc, &sent, dest, true);
+  return rc;
+}
+
+int rec_read_registers(recorder *rec, modbus_t *ctx, int addr, int nb, uint16_t *dest)
+{
+  struct timespec sent;
+  int rc;
+
+  if (rec == NULL)
+    return modbus_read_registers(ctx, addr, nb, dest);
+
+  clock_gettime(CLOCK_MONOTONIC, &sent);
+  rc = modbus_read_registers(ctx, addr, nb, dest);
+  rec_log(rec, MODBUS_FC_READ_HOLDING_REGISTERS, addr, nb, rc, &sent, dest, false);
+  return rc;
+}
+
+int rec_read_input_registers(recorder *rec, modbus_t *ctx, int addr, int nb, uint16_t *dest)
+{
+  struct timespec sent;
+  int rc;
+
+  if (rec == NULL)
+    return modbus_read_input_registers(ctx, addr, nb, dest);
+
+  clock_gettime(CLOCK_MONOTONIC, &sent);
+  rc = modbus_read_input_registers(ctx, addr, nb, dest);
+  rec_log(rec, MODBUS_FC_READ_INPUT_REGISTERS, addr, nb, rc, &sent, dest, false);
+  return rc;
+}
+
+int rec_write_bit(recorder *rec, modbus_t *ctx, int addr, int status)
+{
+  struct timespec sent;
+  uint8_t bit = status;
+  int rc;
+
+  if (rec == NULL)
+    return modbus_write_bit(ctx, addr, status);
+
+  clock_gettime(CLOCK_MONOTONIC, &sent);
+  rc = modbus_write_bit(ctx, addr, status);
+  rec_log(rec, MODBUS_FC_WRITE_SINGLE_COIL, addr, 1, rc, &sent, &bit, true);
+  return rc;
+}
+
+int rec_write_register(recorder *rec, modbus_t *ctx, int addr, uint16_t value)
+{
+  struct timespec sent;
+  int rc;
+
+  if (rec == NULL)
+    return modbus_write_register(ctx, addr, value);
+
+  clock_gettime(CLOCK_MONOTONIC, &sent);
+  rc = modbus_write_register(ctx, addr, value);
+  rec_log(rec, MODBUS_FC_WRITE_SINGLE_REGISTER, addr, 1, rc, &sent, &value, false);
+  return rc;
+}
+
+int rec_write_bits(recorder *rec, modbus_t *ctx, int addr, int nb, const uint8_t *src)
+{
+  struct timespec sent;
+  int rc;
+
+  if (rec == NULL)
+    return modbus_write_bits(ctx, addr, nb, src);
+
+  clock_gettime(CLOCK_MONOTONIC, &sent);
+  rc = modbus_write_bits(ctx, addr, nb, src);
+  rec_log(rec, MODBUS_FC_WRITE_MULTIPLE_COILS, addr, nb, rc, &sent, src, true);
+  return rc;
+}
+
+int rec_write_registers(recorder *rec, modbus_t *ctx, int addr, int nb, const uint16_t *src)
+{
+  struct timespec sent;
+  int rc;
+
+  if (rec == NULL)
+    return modbus_write_registers(ctx, addr, nb, src);
+
+  clock_gettime(CLOCK_MONOTONIC, &sent);
+  rc = modbus_write_registers(ctx, addr, nb, src);
+  rec_log(rec, MODBUS_FC_WRITE_MULTIPLE_REGISTERS, addr, nb, rc, &sent, src, false);
+  return rc;
+}
@@ -0,0 +1,68 @@
+#include <modbus.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+// Recording file format, host byte order:
+// one rec_header, then a rec_entry per downstream request followed by
+// length bytes of payload. Bit payloads are packed 8 to a byte, register
+// payloads are count uint16s. Failed requests carry no payload, only
+// the errno libmodbus gave, which tells exception replies from timeouts.
+
+// Older libmodbus keeps the function codes private
+#ifndef MODBUS_FC_READ_COILS
+#define MODBUS_FC_READ_COILS                0x01
+#define MODBUS_FC_READ_DISCRETE_INPUTS      0x02
+#define MODBUS_FC_READ_HOLDING_REGISTERS    0x03
+#define MODBUS_FC_READ_INPUT_REGISTERS      0x04
+#define MODBUS_FC_WRITE_SINGLE_COIL         0x05
+#define MODBUS_FC_WRITE_SINGLE_REGISTER     0x06
+#define MODBUS_FC_WRITE_MULTIPLE_COILS      0x0F
+#define MODBUS_FC_WRITE_MULTIPLE_REGISTERS  0x10
+#endif
+#ifndef MODBUS_FC_WRITE_AND_READ_REGISTERS
+#define MODBUS_FC_WRITE_AND_READ_REGISTERS  0x17
+#endif
+
+#define REC_MAGIC "MBAGREC"
+#define REC_VERSION 2
+
+typedef struct __attribute__((packed)) rec_header
+{
+  char magic[8];
+  uint16_t version;
+  uint16_t slaveid;
+  char name[50];
+} rec_header;
+
+typedef struct __attribute__((packed)) rec_entry
+{
+  uint64_t time_us;
+  uint32_t latency_us;
+  uint8_t function;
+  uint8_t failed;
+  uint32_t error;
+  uint16_t addr;
+  uint16_t count;
+  uint16_t length;
+} rec_entry;
+
+typedef struct recorder
+{
+  FILE *fp;
+  struct timespec start;
+  struct timespec last_flush;
+} recorder;
+
+recorder *rec_open(const char *dir, const char *name, int slaveid);
+
+// Drop in replacements for the libmodbus calls used by the poll threads.
+// With a NULL recorder they just make the call
+int rec_read_bits(recorder *rec, modbus_t *ctx, int addr, int nb, uint8_t *dest);
+int rec_read_input_bits(recorder *rec, modbus_t *ctx, int addr, int nb, uint8_t *dest);
+int rec_read_registers(recorder *rec, modbus_t *ctx, int addr, int nb, uint16_t *dest);
+int rec_read_input_registers(recorder *rec, modbus_t *ctx, int addr, int nb, uint16_t *dest);
+int rec_write_bit(recorder *rec, modbus_t *ctx, int addr, int status);
+int rec_write_register(recorder *rec, modbus_t *ctx, int addr, uint16_t value);
+int rec_write_bits(recorder *rec, modbus_t *ctx, int addr, int nb, const uint8_t *src);
+int rec_write_registers(recorder *rec, modbus_t *ctx, int addr, int nb, const uint16_t *src);
@@ -0,0 +1,431 @@
+/*
+ * Modbus Aggregator - traffic replay
+ * Copyright © 2020 Alex Evans
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the BSD License.
+ */
+
+// Stands up one simulated slave per recording made with record_dir,
+// answering each request with the recorded data after the recorded latency.
+//
+// Usage: modbus-replay [-a address] [-n] port:file.rec [port:file.rec ...]
+//        modbus-replay -d file.rec
+//
+// -n answers immediately instead of replaying latencies, -d dumps a recording
+
+
+#include <stdio.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <modbus.h>
+
+#include "record.h"
+
+#define MAX_SLAVES 100
+
+// Entries sorted by request, then recorded order, for find_entry
+typedef struct entry_key
+{
+  uint64_t key;
+  size_t n;
+} entry_key;
+
+typedef struct replay_slave
+{
+  const char *path;
+  int port;
+  rec_header header;
+  uint8_t *data;
+  size_t *index;
+  entry_key *keys;
+  size_t count;
+  size_t cursor;
+  modbus_mapping_t *mapping;
+} replay_slave;
+
+const char *ip_addr = "127.0.0.1";
+bool replay_latency = true;
+
+static rec_entry *entry_at(replay_slave *slave, size_t n)
+{
+  return (rec_entry *)(slave->data + slave->index[n]);
+}
+
+static uint64_t request_key(int function, int addr, int count)
+{
+  return ((uint64_t)function << 32) | ((uint64_t)addr << 16) | (uint64_t)count;
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+  const entry_key *ka = a, *kb = b;
+
+  if (ka->key != kb->key)
+    return (ka->key < kb->key) ? -1 : 1;
+  return (ka->n < kb->n) ? -1 : (ka->n > kb->n);
+}
+
+// Read a whole recording into memory and index its entries.
+// A truncated entry at the end, from an unclean shutdown, is dropped
+static int load_recording(replay_slave *slave)
+{
+  FILE *fp;
+  long size;
+  size_t pos, n;
+
+  fp = fopen(slave->path, "rb");
+  if (fp == NULL)
+  {
+    fprintf(stderr, "Cannot open %s: %s\n", slave->path, strerror(errno));
+    return -1;
+  }
+
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  rewind(fp);
+
+  if ((size < (long)sizeof(rec_header)) || (fread(&slave->header, sizeof(rec_header), 1, fp) != 1)
+    || (memcmp(slave->header.magic, REC_MAGIC, sizeof(REC_MAGIC)) != 0)
+    || (slave->header.version != REC_VERSION))
+  {
+    fprintf(stderr, "%s is not a modbus-agg recording\n", slave->path);
+    fclose(fp);
+    return -1;
+  }
+
+  size -= sizeof(rec_header);
+  slave->data = malloc(size);
+  if ((slave->data == NULL) || (fread(slave->data, 1, size, fp) != (size_t)size))
+  {
+    fprintf(stderr, "Cannot read %s\n", slave->path);
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+
+  // First pass counts, second fills the index
+  for (int pass = 0; pass < 2; pass++)
+  {
+    for (pos = 0, n = 0; pos + sizeof(rec_entry) <= (size_t)size; n++)
+    {
+      rec_entry *entry = (rec_entry *)(slave->data + pos);
+
+      if (pos + sizeof(rec_entry) + entry->length > (size_t)size)
+        break;
+      if (pass)
+        slave->index[n] = pos;
+      pos += sizeof(rec_entry) + entry->length;
+    }
+
+    if (!pass)
+    {
+      slave->count = n;
+      slave->index = malloc((n ? n : 1) * sizeof(size_t));
+      if (slave->index == NULL)
+        return -1;
+    }
+  }
+
+  if (slave->count == 0)
+  {
+    fprintf(stderr, "%s holds no requests\n", slave->path);
+    return -1;
+  }
+
+  slave->keys = malloc(slave->count * sizeof(entry_key));
+  if (slave->keys == NULL)
+    return -1;
+  for (n = 0; n < slave->count; n++)
+  {
+    rec_entry *entry = entry_at(slave, n);
+
+    slave->keys[n].key = request_key(entry->function, entry->addr, entry->count);
+    slave->keys[n].n = n;
+  }
+  qsort(slave->keys, slave->count, sizeof(entry_key), compare_keys);
+
+  return 0;
+}
+
+// First key at or after (key, n), or count if there is none
+static size_t lower_bound(replay_slave *slave, uint64_t key, size_t n)
+{
+  entry_key probe = { key, n };
+  size_t lo = 0, hi = slave->count;
+
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (compare_keys(&slave->keys[mid], &probe) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+// Find the next recorded request matching this one, in recorded order.
+// The aggregator asks in the same order it recorded, so this is usually
+// the very next entry. Loops back to the first match when the recording
+// runs out. The sorted keys keep a request that was never recorded from
+// costing a scan of the whole recording
+static rec_entry *find_entry(replay_slave *slave, int function, int addr, int count)
+{
+  uint64_t key = request_key(function, addr, count);
+  size_t k = lower_bound(slave, key, slave->cursor);
+
+  if ((k == slave->count) || (slave->keys[k].key != key))
+    k = lower_bound(slave, key, 0);
+  if ((k == slave->count) || (slave->keys[k].key != key))
+    return NULL;
+
+  slave->cursor = (slave->keys[k].n + 1) % slave->count;
+  return entry_at(slave, slave->keys[k].n);
+}
+
+// Load a recorded read response into the mapping so modbus_reply returns it
+static void apply_entry(modbus_mapping_t *mapping, rec_entry *entry)
+{
+  const uint8_t *payload = (const uint8_t *)(entry + 1);
+  uint8_t *bits = NULL;
+  uint16_t *regs = NULL;
+
+  if (entry->addr + entry->count > UINT16_MAX + 1)
+    return;
+
+  switch (entry->function)
+  {
+    case MODBUS_FC_READ_COILS:
+      bits = mapping->tab_bits;
+      break;
+    case MODBUS_FC_READ_DISCRETE_INPUTS:
+      bits = mapping->tab_input_bits;
+      break;
+    case MODBUS_FC_READ_HOLDING_REGISTERS:
+      regs = mapping->tab_registers;
+      break;
+    case MODBUS_FC_READ_INPUT_REGISTERS:
+      regs = mapping->tab_input_registers;
+      break;
+    default:
+      return;
+  }
+
+  if ((bits) && (entry->length * 8 >= entry->count))
+  {
+    for (int i = 0; i < entry->count; i++)
+      bits[entry->addr + i] = (payload[i/8] >> (i%8)) & 1;
+  }
+  else if ((regs) && (entry->length == entry->count * sizeof(uint16_t)))
+  {
+    memcpy(&regs[entry->addr], payload, entry->length);
+  }
+}
+
+static bool is_exception(uint32_t error)
+{
+  return (error > MODBUS_ENOBASE) && (error < MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX);
+}
+
+static void sleep_us(uint32_t us)
+{
+  struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+void *serve_slave(void *slave_struct)
+{
+  replay_slave *slave = slave_struct;
+  uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
+  modbus_t *ctx;
+  int server_socket, header_length;
+
+  ctx = modbus_new_tcp(ip_addr, slave->port);
+  header_length = modbus_get_header_length(ctx);
+
+  server_socket = modbus_tcp_listen(ctx, 1);
+  if (server_socket == -1)
+  {
+    fprintf(stderr, "%s: cannot listen on port %d: %s\n", slave->header.name, slave->port, modbus_strerror(errno));
+    modbus_free(ctx);
+    return NULL;
+  }
+
+  printf("Replaying %s (%zu requests) on %s:%d\n", slave->header.name, slave->count, ip_addr, slave->port);
+
+  // The aggregator may open a new connection every poll, so keep accepting
+  for (;;)
+  {
+    int conn = modbus_tcp_accept(ctx, &server_socket);
+    int rc;
+
+    if (conn == -1)
+    {
+      perror("Replay accept() error");
+      continue;
+    }
+
+    while ((rc = modbus_receive(ctx, query)) != -1)
+    {
+      int function, addr, count;
+      rec_entry *entry;
+
+      if (rc == 0)
+        continue;
+
+      function = query[header_length];
+      addr = (query[header_length+1] << 8) | query[header_length+2];
+      if ((function == MODBUS_FC_WRITE_SINGLE_COIL) || (function == MODBUS_FC_WRITE_SINGLE_REGISTER))
+        count = 1;
+      else
+        count = (query[header_length+3] << 8) | query[header_length+4];
+
+      // Requests that were never recorded are answered from the mapping as is
+      entry = find_entry(slave, function, addr, count);
+      if (entry != NULL)
+      {
+        if (replay_latency)
+          sleep_us(entry->latency_us);
+
+        // A device that answered with an exception gets the same exception.
+        // Anything else that failed in the field, timeouts and broken
+        // connections, gets no answer so the aggregator times out again
+        if (entry->failed)
+        {
+          if (is_exception(entry->error))
+            modbus_reply_exception(ctx, query, entry->error - MODBUS_ENOBASE);
+          continue;
+        }
+
+        apply_entry(slave->mapping, entry);
+      }
+
+      modbus_reply(ctx, query, rc, slave->mapping);
+    }
+
+    close(conn);
+  }
+
+  return NULL;
+}
+
+static void dump_recording(replay_slave *slave)
+{
+  uint64_t latency_sum = 0, failures = 0;
+
+  printf("%s: %s slave #%d, %zu requests\n", slave->path, slave->header.name, slave->header.slaveid, slave->count);
+
+  for (size_t n = 0; n < slave->count; n++)
+  {
+    rec_entry *entry = entry_at(slave, n);
+
+    printf("%10.3fs fc %02d addr %5d count %4d %8uus%s%s\n", entry->time_us / 1e6, entry->function,
+      entry->addr, entry->count, entry->latency_us, entry->failed ? " FAILED: " : "",
+      entry->failed ? modbus_strerror(entry->error) : "");
+    latency_sum += entry->latency_us;
+    failures += entry->failed;
+  }
+
+  printf("avg latency %lluus, %llu failed\n", (unsigned long long)(latency_sum / slave->count),
+    (unsigned long long)failures);
+}
+
+int main(int argc, char **argv)
+{
+  pthread_t slavethread[MAX_SLAVES];
+  replay_slave slaves[MAX_SLAVES] = {0};
+  int slave_count = 0;
+  bool dump = false;
+  int c;
+
+  opterr = 0;
+
+  while ((c = getopt (argc, argv, "a:nd")) != -1)
+    switch (c)
+    {
+      case 'a':
+        ip_addr = optarg;
+        break;
+      case 'n':
+        replay_latency = false;
+        break;
+      case 'd':
+        dump = true;
+        break;
+      case '?':
+        if (optopt == 'a')
+          fprintf (stderr, "Option -%c requires an argument.\n", optopt);
+        else if (isprint (optopt))
+          fprintf (stderr, "Unknown option `-%c'.\n", optopt);
+        else
+          fprintf (stderr, "Unknown option character `\\x%x'.\n", optopt);
+        return 1;
+      default:
+        abort ();
+    }
+
+  if (optind >= argc)
+  {
+    fprintf(stderr, "Usage: %s [-a address] [-n] port:file.rec ...\n       %s -d file.rec\n", argv[0], argv[0]);
+    return 1;
+  }
+
+  for (int index = optind; (index < argc) && (slave_count < MAX_SLAVES); index++)
+  {
+    replay_slave *slave = &slaves[slave_count];
+    char *sep = strchr(argv[index], ':');
+
+    if (dump)
+    {
+      slave->path = argv[index];
+    }
+    else if ((sep == NULL) || ((slave->port = atoi(argv[index])) <= 0))
+    {
+      fprintf(stderr, "%s should be port:file.rec\n", argv[index]);
+      return 1;
+    }
+    else
+    {
+      slave->path = sep + 1;
+    }
+
+    if (load_recording(slave) != 0)
+      return 1;
+
+    if (dump)
+    {
+      dump_recording(slave);
+      continue;
+    }
+
+    slave->mapping = modbus_mapping_new(UINT16_MAX+1, UINT16_MAX+1, UINT16_MAX+1, UINT16_MAX+1);
+    if (slave->mapping == NULL)
+    {
+      fprintf(stderr, "Failed to allocate the mapping: %s\n", modbus_strerror(errno));
+      return 1;
+    }
+
+    slave_count++;
+  }
+
+  for (int i = 0; i < slave_count; i++)
+  {
+    if (pthread_create(&slavethread[i], NULL, serve_slave, &slaves[i]))
+      fprintf(stderr, "Replay thread %d creation failed\n", i);
+  }
+
+  for (int i = 0; i < slave_count; i++)
+    pthread_join(slavethread[i], NULL);
+
+  return 0;
+}